@@ -6,9 +6,11 @@
 
 #include <dlfcn.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <ffi.h>
 
@@ -17,6 +19,28 @@
 #include "xwalk/XW_Extension_SyncMessage.h"
 
 #define EXTENSION_MAX 64
+#define TOPIC_MAX 64
+
+// How long the dispatcher thread keeps draining queued messages once it holds
+// the Python lock, before handing it back to the other Python threads.
+#define DISPATCH_BUDGET_NS 2000000L
+
+// Size of the ring of queued messages. Once it is full, the Crosswalk thread
+// waits until the dispatcher has drained it down to half, so a slow handler
+// cannot grow the queue without bound and the two threads don't ping-pong
+// on every message.
+#define DISPATCH_QUEUE_MAX 1024
+
+// Messages shorter than this are copied into their queue slot, so the
+// Crosswalk thread doesn't allocate for them.
+#define DISPATCH_INLINE_SIZE 128
+
+// After draining the queue the dispatcher keeps the Python lock for up to
+// this long, within DISPATCH_BUDGET_NS, in case more messages follow.
+// Meanwhile the Crosswalk thread doesn't wake it up unless the queue fills up
+// to a quarter, so a burst is handled in a few large batches instead of one
+// wake-up and one lock hand-off per message.
+#define DISPATCH_LINGER_NS 200000L
 
 // XWalk hooks
 static const XW_MessagingInterface* g_xw_messaging = NULL;
@@ -25,29 +49,134 @@ static const XW_Internal_SyncMessagingInterface* g_xw_sync_messaging = NULL;
 // Python hooks
 static PyObject* g_py_messaging[EXTENSION_MAX];
 static PyObject* g_py_sync_messaging[EXTENSION_MAX];
+static PyObject* g_py_batch_messaging[EXTENSION_MAX];
 static PyObject* g_py_instance_created = NULL;
 static PyObject* g_py_instance_destroyed = NULL;
 
+// Instances currently alive, with the name of the extension owning them, and
+// the topics they are subscribed to. All Python extensions loaded in the
+// process share these tables, so entries are keyed by extension name, whose
+// pointer is unique per extension. Both are guarded by |g_instance_lock|
+// rather than the Python lock: Broadcast() and Publish() fan out with the
+// Python lock released but the lock held for reading, so an instance cannot
+// be destroyed while a message is being posted to it. The lock is never
+// waited for while holding the Python lock.
+struct live_instance {
+  XW_Instance instance;
+  const char* extension_name;
+};
+
+struct topic {
+  char* name;
+  const char* extension_name;
+  XW_Instance* subscribers;
+  int subscriber_count;
+  int subscriber_capacity;
+};
+
+static pthread_rwlock_t g_instance_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct live_instance* g_instances = NULL;
+static int g_instance_count = 0;
+static int g_instance_capacity = 0;
+static struct topic g_topics[TOPIC_MAX];
+
+// User data of the instance created/destroyed closures, one per extension.
+struct instance_callback {
+  PyObject* callback;
+  const char* extension_name;
+};
+
+// Sampling profiler. A native thread counts timer ticks |g_profiler_hz|
+// times per second without touching Python. While profiling, threads running
+// a callback install a profile function that, at the next Python call or
+// return after a tick, records their own stack weighted by the ticks elapsed.
+// Samples are thus taken when the tick fires rather than when the Python lock
+// changes hands, and short callbacks are not missed. The callback being run
+// is tracked per thread, as sync and asynchronous messages are handled on
+// different threads.
+// While StopProfiler() waits for the thread and writes the samples out,
+// |g_profiler_stopping| keeps StartProfiler() from starting a new session.
+#define PROFILER_MAX_HZ 1000
+
+static pthread_t g_profiler_thread;
+static volatile int g_profiler_running = 0;
+static int g_profiler_stopping = 0;
+static int g_profiler_hz = 0;
+static volatile unsigned long g_profiler_ticks = 0;
+static PyObject* g_profiler_samples = NULL;
+static __thread int t_profiler_tracing = 0;
+static __thread unsigned long t_profiler_ticks = 0;
+static __thread XW_Instance t_profiler_instance = 0;
+static __thread const char* t_profiler_extension = NULL;
+
 // The thread in which XW_Initialize() gets called becomes the main thread.
 // It must release the global lock when returning to Crosswalk and restore
 // it when called again. Otherwise Python code called by other threads cannot
 // run. The assumption is that Crosswalk will always call the extension from
 // the same thread.
 //
+// Sync message and instance created/destroyed callbacks run on that thread.
+// Asynchronous message callbacks (SetMessageCallback() and
+// SetBatchMessageCallback()) run on a separate dispatcher thread, see below,
+// so threading.current_thread() and threading.local() data differ between
+// the two kinds of callbacks.
+//
 // Without this thread support, pycloudeebus in xwalk-launcher does not work:
 // the main thread is running the glib event loop in which twisted reacts
 // to D-Bus calls, while the second thread runs a Crosswalk event loop and
 // would hold the Python lock if we didn't release it.
 static PyThreadState* g_py_save_state;
 
+// Asynchronous messages don't need a reply, so instead of taking the Python
+// lock for each of them on the Crosswalk thread they are queued in a ring
+// and handled by a dispatcher thread. Once it holds the lock, it drains every
+// message already queued, up to DISPATCH_BUDGET_NS, so bursts pay for a
+// single lock hand-off. Sync messages and instance callbacks flush the queue
+// first to preserve the ordering seen by Python.
+struct queued_message {
+  XW_Instance instance;
+  char* message;
+  char inline_message[DISPATCH_INLINE_SIZE];
+};
+
+enum {
+  DISPATCH_BUSY,
+  DISPATCH_LINGERING,
+  DISPATCH_SLEEPING
+};
+
+static pthread_t g_dispatch_thread;
+static pthread_mutex_t g_dispatch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_dispatch_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_dispatch_idle = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_dispatch_space = PTHREAD_COND_INITIALIZER;
+static struct queued_message g_dispatch_queue[DISPATCH_QUEUE_MAX];
+static int g_dispatch_head = 0;
+static int g_dispatch_length = 0;
+static int g_dispatch_state = DISPATCH_BUSY;
+static int g_dispatch_producer_waiting = 0;
+static int g_dispatch_yield = 0;
+static int g_dispatch_running = 0;
+
+// Python extensions initialized in this process. They share the
+// interpreter, which is only finalized when the last one shuts down.
+static int g_extension_count = 0;
+
 static char* g_extension_name = NULL;
 static char* g_javascript_api = NULL;
 
 static PyObject* py_set_extension_name(PyObject* self, PyObject* args);
 static PyObject* py_set_javascript_api(PyObject* self, PyObject* args);
 static PyObject* py_post_message(PyObject* self, PyObject* args);
+static PyObject* py_broadcast(PyObject* self, PyObject* args);
+static PyObject* py_subscribe(PyObject* self, PyObject* args);
+static PyObject* py_unsubscribe(PyObject* self, PyObject* args);
+static PyObject* py_publish(PyObject* self, PyObject* args);
+static PyObject* py_start_profiler(PyObject* self, PyObject* args);
+static PyObject* py_stop_profiler(PyObject* self, PyObject* args);
 static PyObject* py_set_message_callback(PyObject* self, PyObject* args);
 static PyObject* py_set_sync_message_callback(PyObject* self, PyObject* args);
+static PyObject* py_set_batch_message_callback(PyObject* self, PyObject* args);
 static PyObject* py_set_instance_created_callback(PyObject* self, PyObject* args);
 static PyObject* py_set_instance_destroyed_callback(PyObject* self, PyObject* args);
 
@@ -55,8 +184,15 @@ static PyMethodDef PyXWalkMethods[] = {
   {"SetExtensionName", py_set_extension_name, METH_VARARGS, ""},
   {"SetJavaScriptAPI", py_set_javascript_api, METH_VARARGS, ""},
   {"PostMessage", py_post_message, METH_VARARGS, ""},
+  {"Broadcast", py_broadcast, METH_VARARGS, ""},
+  {"Subscribe", py_subscribe, METH_VARARGS, ""},
+  {"Unsubscribe", py_unsubscribe, METH_VARARGS, ""},
+  {"Publish", py_publish, METH_VARARGS, ""},
+  {"StartProfiler", py_start_profiler, METH_VARARGS, ""},
+  {"StopProfiler", py_stop_profiler, METH_VARARGS, ""},
   {"SetMessageCallback", py_set_message_callback, METH_VARARGS, ""},
   {"SetSyncMessageCallback", py_set_sync_message_callback, METH_VARARGS, ""},
+  {"SetBatchMessageCallback", py_set_batch_message_callback, METH_VARARGS, ""},
   {"SetInstanceCreatedCallback", py_set_instance_created_callback, METH_VARARGS, ""},
   {"SetInstanceDestroyedCallback", py_set_instance_destroyed_callback, METH_VARARGS, ""},
   {NULL, NULL, 0, NULL}
@@ -64,16 +200,31 @@ static PyMethodDef PyXWalkMethods[] = {
 
 static const char PY_XWALK_MODULE_NAME[] = "xwalk";
 
+// Each extension gets its own xwalk module object, so the module functions
+// find out which extension is calling them through |self|: it is the module
+// itself in Python 3, and a capsule passed to Py_InitModule4() in Python 2.
+struct module_state {
+  const char* extension_name;
+};
+
 // #define LOGGING 1
 
 #if PY_MAJOR_VERSION >= 3
 static struct PyModuleDef PyXWalkModule = {
   PyModuleDef_HEAD_INIT,
-  PY_XWALK_MODULE_NAME, "", -1, PyXWalkMethods,
+  PY_XWALK_MODULE_NAME, "", sizeof(struct module_state), PyXWalkMethods,
   NULL, NULL, NULL, NULL
 };
 #endif
 
+static struct module_state* get_module_state(PyObject* self) {
+#if PY_MAJOR_VERSION >= 3
+  return (struct module_state*) PyModule_GetState(self);
+#else
+  return (struct module_state*) PyCapsule_GetPointer(self, NULL);
+#endif
+}
+
 static PyObject* py_post_message(PyObject* self, PyObject* args) {
   int instance;
   char *result;
@@ -91,6 +242,483 @@ static PyObject* py_post_message(PyObject* self, PyObject* args) {
   Py_RETURN_TRUE;
 }
 
+// Grows |*array| to hold at least |count| + 1 elements of |size| bytes.
+// Returns 0 if out of memory, leaving the array untouched.
+static int reserve_one(void** array, int* capacity, int count, size_t size) {
+  if (count < *capacity)
+    return 1;
+
+  int new_capacity = *capacity ? *capacity * 2 : 16;
+  void* new_array = realloc(*array, new_capacity * size);
+  if (!new_array)
+    return 0;
+
+  *array = new_array;
+  *capacity = new_capacity;
+  return 1;
+}
+
+// Must be called with |g_instance_lock| held.
+static int find_instance(XW_Instance instance) {
+  int i;
+  for (i = 0; i < g_instance_count; ++i) {
+    if (g_instances[i].instance == instance)
+      return i;
+  }
+  return -1;
+}
+
+// Returns the name of the extension owning |instance|, or NULL if the
+// instance is not alive.
+static const char* instance_extension(XW_Instance instance) {
+  const char* extension_name = NULL;
+
+  pthread_rwlock_rdlock(&g_instance_lock);
+  int index = find_instance(instance);
+  if (index >= 0)
+    extension_name = g_instances[index].extension_name;
+  pthread_rwlock_unlock(&g_instance_lock);
+
+  return extension_name;
+}
+
+// Posts |message| to every instance of the calling extension.
+static PyObject* py_broadcast(PyObject* self, PyObject* args) {
+  char* message;
+
+  if(!PyArg_ParseTuple(args, "s", &message)) {
+    PyErr_Print();
+    Py_RETURN_FALSE;
+  }
+
+  const char* extension_name = get_module_state(self)->extension_name;
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_rwlock_rdlock(&g_instance_lock);
+  int i;
+  for (i = 0; i < g_instance_count; ++i) {
+    if (g_instances[i].extension_name != extension_name)
+      continue;
+#ifdef LOGGING
+    fprintf(stderr, "pycrosswalk %d: posting message: %s\n",
+            g_instances[i].instance, message);
+#endif
+    g_xw_messaging->PostMessage(g_instances[i].instance, message);
+  }
+  pthread_rwlock_unlock(&g_instance_lock);
+  Py_END_ALLOW_THREADS
+
+  Py_RETURN_TRUE;
+}
+
+// Topics are private to the extension that created them. Must be called
+// with |g_instance_lock| held, for writing if |create| is set.
+static struct topic* find_topic(const char* extension_name, const char* name,
+                                int create) {
+  struct topic* free_slot = NULL;
+  int i;
+  for (i = 0; i < TOPIC_MAX; ++i) {
+    if (!g_topics[i].name) {
+      if (!free_slot)
+        free_slot = &g_topics[i];
+    } else if (g_topics[i].extension_name == extension_name &&
+               !strcmp(g_topics[i].name, name)) {
+      return &g_topics[i];
+    }
+  }
+
+  if (!create || !free_slot)
+    return NULL;
+
+  free_slot->name = strdup(name);
+  if (!free_slot->name)
+    return NULL;
+
+  free_slot->extension_name = extension_name;
+  return free_slot;
+}
+
+// Removes |instance| from the subscribers of |topic| and releases the topic
+// slot once nobody is subscribed anymore. Must be called with
+// |g_instance_lock| held for writing.
+static void remove_subscriber(struct topic* topic, XW_Instance instance) {
+  int i;
+  for (i = 0; i < topic->subscriber_count; ++i) {
+    if (topic->subscribers[i] == instance) {
+      topic->subscribers[i] = topic->subscribers[--topic->subscriber_count];
+      break;
+    }
+  }
+
+  if (topic->subscriber_count)
+    return;
+
+  free(topic->name);
+  free(topic->subscribers);
+  memset(topic, 0, sizeof(*topic));
+}
+
+// Must be called with |g_instance_lock| held for writing.
+static int add_subscriber(const char* extension_name, const char* name,
+                          XW_Instance instance) {
+  int index = find_instance(instance);
+  if (index < 0 || g_instances[index].extension_name != extension_name)
+    return 0;
+
+  struct topic* topic = find_topic(extension_name, name, 1);
+  if (!topic)
+    return 0;
+
+  int i;
+  for (i = 0; i < topic->subscriber_count; ++i) {
+    if (topic->subscribers[i] == instance)
+      return 1;
+  }
+
+  if (reserve_one((void**) &topic->subscribers, &topic->subscriber_capacity,
+                  topic->subscriber_count, sizeof(XW_Instance))) {
+    topic->subscribers[topic->subscriber_count++] = instance;
+    return 1;
+  }
+
+  // Don't keep a slot for a topic created by a failed subscription.
+  if (!topic->subscriber_count)
+    remove_subscriber(topic, instance);
+  return 0;
+}
+
+static PyObject* py_subscribe(PyObject* self, PyObject* args) {
+  int instance = 0;
+  char* name = NULL;
+
+  if(!PyArg_ParseTuple(args, "is", &instance, &name)) {
+    PyErr_Print();
+    Py_RETURN_FALSE;
+  }
+
+  const char* extension_name = get_module_state(self)->extension_name;
+  int subscribed;
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_rwlock_wrlock(&g_instance_lock);
+  subscribed = add_subscriber(extension_name, name, instance);
+  pthread_rwlock_unlock(&g_instance_lock);
+  Py_END_ALLOW_THREADS
+
+  if (!subscribed)
+    Py_RETURN_FALSE;
+
+  Py_RETURN_TRUE;
+}
+
+static PyObject* py_unsubscribe(PyObject* self, PyObject* args) {
+  int instance = 0;
+  char* name = NULL;
+
+  if(!PyArg_ParseTuple(args, "is", &instance, &name)) {
+    PyErr_Print();
+    Py_RETURN_FALSE;
+  }
+
+  const char* extension_name = get_module_state(self)->extension_name;
+  struct topic* topic;
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_rwlock_wrlock(&g_instance_lock);
+  topic = find_topic(extension_name, name, 0);
+  if (topic)
+    remove_subscriber(topic, instance);
+  pthread_rwlock_unlock(&g_instance_lock);
+  Py_END_ALLOW_THREADS
+
+  if (!topic)
+    Py_RETURN_FALSE;
+
+  Py_RETURN_TRUE;
+}
+
+static PyObject* py_publish(PyObject* self, PyObject* args) {
+  char* name = NULL;
+  char* message = NULL;
+
+  if(!PyArg_ParseTuple(args, "ss", &name, &message)) {
+    PyErr_Print();
+    Py_RETURN_FALSE;
+  }
+
+  const char* extension_name = get_module_state(self)->extension_name;
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_rwlock_rdlock(&g_instance_lock);
+  struct topic* topic = find_topic(extension_name, name, 0);
+  int i;
+  for (i = 0; topic && i < topic->subscriber_count; ++i) {
+#ifdef LOGGING
+    fprintf(stderr, "pycrosswalk %d: posting message: %s\n",
+            topic->subscribers[i], message);
+#endif
+    g_xw_messaging->PostMessage(topic->subscribers[i], message);
+  }
+  pthread_rwlock_unlock(&g_instance_lock);
+  Py_END_ALLOW_THREADS
+
+  Py_RETURN_TRUE;
+}
+
+// Adds |instance| to the live instances, or removes it (and its
+// subscriptions) when |extension_name| is NULL. Removal waits for any
+// Broadcast() or Publish() in progress to finish, so this must be called
+// without the Python lock.
+static void set_instance_extension(XW_Instance instance,
+                                   const char* extension_name) {
+  pthread_rwlock_wrlock(&g_instance_lock);
+  int index = find_instance(instance);
+
+  if (extension_name) {
+    if (index < 0 &&
+        reserve_one((void**) &g_instances, &g_instance_capacity,
+                    g_instance_count, sizeof(struct live_instance)))
+      index = g_instance_count++;
+
+    if (index >= 0) {
+      g_instances[index].instance = instance;
+      g_instances[index].extension_name = extension_name;
+    } else {
+      fprintf(stderr, "pycrosswalk %d: could not track instance.\n", instance);
+    }
+  } else if (index >= 0) {
+    g_instances[index] = g_instances[--g_instance_count];
+
+    int i;
+    for (i = 0; i < TOPIC_MAX; ++i) {
+      if (g_topics[i].name)
+        remove_subscriber(&g_topics[i], instance);
+    }
+  }
+
+  pthread_rwlock_unlock(&g_instance_lock);
+}
+
+// Frame accessors returning new references, as the frame struct became
+// opaque in later Python versions.
+static PyFrameObject* profiler_frame_back(PyFrameObject* frame) {
+#if PY_VERSION_HEX >= 0x03090000
+  return PyFrame_GetBack(frame);
+#else
+  Py_XINCREF(frame->f_back);
+  return frame->f_back;
+#endif
+}
+
+static PyCodeObject* profiler_frame_code(PyFrameObject* frame) {
+#if PY_VERSION_HEX >= 0x03090000
+  return PyFrame_GetCode(frame);
+#else
+  Py_INCREF(frame->f_code);
+  return frame->f_code;
+#endif
+}
+
+// Records the stack ending at |frame| as a collapsed stack
+// ("extension;instance N;outer;...;inner") in |g_profiler_samples|, counted
+// |weight| times. Must be called with the Python lock held.
+static void profiler_take_sample(PyFrameObject* frame, unsigned long weight) {
+  // The owning extension is only looked up once per callback, and only if
+  // a sample is actually taken.
+  if (!t_profiler_extension)
+    t_profiler_extension = instance_extension(t_profiler_instance);
+
+  PyObject* frames = PyList_New(0);
+  if (!frames) {
+    PyErr_Print();
+    return;
+  }
+
+  Py_XINCREF(frame);
+  while (frame) {
+    PyCodeObject* code = profiler_frame_code(frame);
+    PyObject* label = PyUnicode_FromFormat("%S (%S:%d)", code->co_name,
+                                           code->co_filename,
+                                           code->co_firstlineno);
+    Py_DECREF(code);
+    if (label) {
+      PyList_Append(frames, label);
+      Py_DECREF(label);
+    }
+
+    PyFrameObject* back = profiler_frame_back(frame);
+    Py_DECREF(frame);
+    frame = back;
+  }
+
+  PyObject* tag = PyUnicode_FromFormat(
+      "%s;instance %d",
+      t_profiler_extension ? t_profiler_extension : "unknown",
+      t_profiler_instance);
+  if (tag) {
+    PyList_Append(frames, tag);
+    Py_DECREF(tag);
+  }
+  PyList_Reverse(frames);
+
+  PyObject* separator = PyUnicode_FromString(";");
+  PyObject* stack = PyUnicode_Join(separator, frames);
+  Py_DECREF(separator);
+  Py_DECREF(frames);
+
+  if (!stack) {
+    PyErr_Print();
+    return;
+  }
+
+  PyObject* count = PyDict_GetItem(g_profiler_samples, stack);
+  PyObject* new_count =
+      PyLong_FromLong((count ? PyLong_AsLong(count) : 0) + (long) weight);
+  PyDict_SetItem(g_profiler_samples, stack, new_count);
+  Py_DECREF(new_count);
+  Py_DECREF(stack);
+}
+
+// Profile function installed on threads running a callback. Returns right
+// away unless a tick fired since the last sample taken on this thread.
+static int profiler_trace(PyObject* obj, PyFrameObject* frame, int what,
+                          PyObject* arg) {
+  unsigned long ticks = g_profiler_ticks;
+  if (ticks == t_profiler_ticks || !g_profiler_running || !g_profiler_samples)
+    return 0;
+
+  profiler_take_sample(frame, ticks - t_profiler_ticks);
+  t_profiler_ticks = ticks;
+  return 0;
+}
+
+static void* profiler_thread_main(void* data) {
+  long interval_ns = 1000000000L / g_profiler_hz;
+  struct timespec interval = {
+    interval_ns / 1000000000L, interval_ns % 1000000000L
+  };
+
+  while (g_profiler_running) {
+    nanosleep(&interval, NULL);
+    ++g_profiler_ticks;
+  }
+
+  return NULL;
+}
+
+// Must be called with the Python lock held. |extension_name| may be NULL if
+// the caller doesn't know it, in which case it is looked up when the first
+// sample is taken.
+static void profiler_enter_callback(XW_Instance instance,
+                                    const char* extension_name) {
+  if (!g_profiler_running)
+    return;
+
+  t_profiler_instance = instance;
+  t_profiler_extension = extension_name;
+  t_profiler_ticks = g_profiler_ticks;
+  t_profiler_tracing = 1;
+  PyEval_SetProfile(profiler_trace, NULL);
+}
+
+// Must be called with the Python lock held.
+static void profiler_leave_callback() {
+  if (!t_profiler_tracing)
+    return;
+
+  t_profiler_tracing = 0;
+  PyEval_SetProfile(NULL, NULL);
+}
+
+// Stops the sampler thread, releasing the Python lock while waiting up to
+// one tick for it to exit. Must be called with the lock held, and
+// leaves |g_profiler_stopping| set for the caller to clear once the samples
+// have been handled.
+static void profiler_stop() {
+  if (!g_profiler_running)
+    return;
+
+  pthread_t thread = g_profiler_thread;
+  g_profiler_stopping = 1;
+  g_profiler_running = 0;
+  Py_BEGIN_ALLOW_THREADS
+  pthread_join(thread, NULL);
+  Py_END_ALLOW_THREADS
+}
+
+static PyObject* py_start_profiler(PyObject* self, PyObject* args) {
+  int hz = 0;
+
+  if(!PyArg_ParseTuple(args, "i", &hz)) {
+    PyErr_Print();
+    Py_RETURN_FALSE;
+  }
+
+  if (hz <= 0 || g_profiler_running || g_profiler_stopping)
+    Py_RETURN_FALSE;
+
+  if (hz > PROFILER_MAX_HZ)
+    hz = PROFILER_MAX_HZ;
+
+  Py_XDECREF(g_profiler_samples);
+  g_profiler_samples = PyDict_New();
+  if (!g_profiler_samples) {
+    PyErr_Print();
+    Py_RETURN_FALSE;
+  }
+
+  g_profiler_hz = hz;
+  g_profiler_running = 1;
+  if (pthread_create(&g_profiler_thread, NULL, profiler_thread_main, NULL)) {
+    fprintf(stderr, "Could not start the pycrosswalk profiler thread.\n");
+    g_profiler_running = 0;
+    Py_RETURN_FALSE;
+  }
+
+  Py_RETURN_TRUE;
+}
+
+static PyObject* py_stop_profiler(PyObject* self, PyObject* args) {
+  char* path = NULL;
+
+  if(!PyArg_ParseTuple(args, "s", &path)) {
+    PyErr_Print();
+    Py_RETURN_FALSE;
+  }
+
+  if (!g_profiler_running || g_profiler_stopping)
+    Py_RETURN_FALSE;
+
+  profiler_stop();
+
+  FILE* output = fopen(path, "w");
+  if (!output) {
+    fprintf(stderr, "Could not open profiler output %s.\n", path);
+    Py_CLEAR(g_profiler_samples);
+    g_profiler_stopping = 0;
+    Py_RETURN_FALSE;
+  }
+
+  PyObject* stack;
+  PyObject* count;
+  Py_ssize_t pos = 0;
+  while (PyDict_Next(g_profiler_samples, &pos, &stack, &count)) {
+    PyObject* bytes = PyUnicode_AsUTF8String(stack);
+    if (!bytes) {
+      PyErr_Print();
+      continue;
+    }
+    fprintf(output, "%s %ld\n", PyBytes_AsString(bytes), PyLong_AsLong(count));
+    Py_DECREF(bytes);
+  }
+  fclose(output);
+
+  Py_CLEAR(g_profiler_samples);
+  g_profiler_stopping = 0;
+
+  Py_RETURN_TRUE;
+}
+
 static PyObject* py_set_extension_name(PyObject* self, PyObject* args) {
   if (g_extension_name)
     Py_RETURN_FALSE;
@@ -125,12 +753,12 @@ static PyObject* py_set_message_callback(PyObject* self, PyObject* args) {
   PyObject* callback = NULL;
   int instance = 0;
 
-  if(!PyArg_ParseTuple(args, "lO", &instance, &callback)) {
+  if(!PyArg_ParseTuple(args, "iO", &instance, &callback)) {
     PyErr_Print();
     Py_RETURN_FALSE;
   }
 
-  if (instance > EXTENSION_MAX || g_py_messaging[instance])
+  if (instance < 0 || instance >= EXTENSION_MAX || g_py_messaging[instance])
     Py_RETURN_FALSE;
 
   Py_INCREF(callback);
@@ -143,12 +771,12 @@ static PyObject* py_set_sync_message_callback(PyObject* self, PyObject* args) {
   PyObject* callback = NULL;
   int instance = 0;
 
-  if(!PyArg_ParseTuple(args, "lO", &instance, &callback)) {
+  if(!PyArg_ParseTuple(args, "iO", &instance, &callback)) {
     PyErr_Print();
     Py_RETURN_FALSE;
   }
 
-  if (instance > EXTENSION_MAX || g_py_sync_messaging[instance])
+  if (instance < 0 || instance >= EXTENSION_MAX || g_py_sync_messaging[instance])
     Py_RETURN_FALSE;
 
   Py_INCREF(callback);
@@ -157,6 +785,24 @@ static PyObject* py_set_sync_message_callback(PyObject* self, PyObject* args) {
   Py_RETURN_TRUE;
 }
 
+static PyObject* py_set_batch_message_callback(PyObject* self, PyObject* args) {
+  PyObject* callback = NULL;
+  int instance = 0;
+
+  if(!PyArg_ParseTuple(args, "iO", &instance, &callback)) {
+    PyErr_Print();
+    Py_RETURN_FALSE;
+  }
+
+  if (instance < 0 || instance >= EXTENSION_MAX || g_py_batch_messaging[instance])
+    Py_RETURN_FALSE;
+
+  Py_INCREF(callback);
+  g_py_batch_messaging[instance] = callback;
+
+  Py_RETURN_TRUE;
+}
+
 static PyObject* py_set_instance_created_callback(PyObject* self, PyObject* args) {
   if (g_py_instance_created)
     Py_RETURN_FALSE;
@@ -183,11 +829,12 @@ static PyObject* py_set_instance_destroyed_callback(PyObject* self, PyObject* ar
   Py_RETURN_TRUE;
 }
 
-static char* py_handle_message(XW_Instance instance,
-                               PyObject* callback,
-                               const char* message) {
+// Must be called with the Python lock held.
+static char* py_call_message(XW_Instance instance,
+                             PyObject* callback,
+                             const char* message) {
   char* pass_string = NULL;
-  PyEval_RestoreThread(g_py_save_state);
+  profiler_enter_callback(instance, NULL);
   PyObject* instance_object = PyLong_FromLong((long) instance);
   PyObject* message_object = PyUnicode_FromString(message);
   PyObject* args = PyTuple_Pack(2, instance_object, message_object);
@@ -228,21 +875,298 @@ static char* py_handle_message(XW_Instance instance,
   Py_DECREF(result_object);
 
  done:
+  profiler_leave_callback();
+  return pass_string;
+}
+
+// Hands a run of messages for the same instance to its batch callback as a
+// list. Must be called with the Python lock held.
+static void py_call_batch_message(XW_Instance instance,
+                                  PyObject* callback,
+                                  int first, int count) {
+  PyObject* message_list = PyList_New(0);
+  if (!message_list) {
+    PyErr_Print();
+    return;
+  }
+
+  int i;
+  for (i = 0; i < count; ++i) {
+    struct queued_message* item =
+        &g_dispatch_queue[(first + i) % DISPATCH_QUEUE_MAX];
+    PyObject* message_object = PyUnicode_FromString(item->message);
+    if (!message_object) {
+      PyErr_Print();
+      continue;
+    }
+    PyList_Append(message_list, message_object);
+    Py_DECREF(message_object);
+  }
+
+  PyObject* instance_object = PyLong_FromLong((long) instance);
+  PyObject* args = PyTuple_Pack(2, instance_object, message_list);
+  Py_DECREF(message_list);
+  Py_DECREF(instance_object);
+
+  if (!args) {
+    PyErr_Print();
+    return;
+  }
+
+#ifdef LOGGING
+  fprintf(stderr, "pycrosswalk %d: handling %zd messages\n", instance,
+          PyList_Size(message_list));
+#endif
+  profiler_enter_callback(instance, NULL);
+  PyObject* result_object = PyObject_CallObject(callback, args);
+  profiler_leave_callback();
+  Py_DECREF(args);
+
+  if (!result_object) {
+    PyErr_Print();
+    return;
+  }
+  Py_DECREF(result_object);
+}
+
+static char* py_handle_message(XW_Instance instance,
+                               PyObject* callback,
+                               const char* message) {
+  PyEval_RestoreThread(g_py_save_state);
+  char* pass_string = py_call_message(instance, callback, message);
   g_py_save_state = PyEval_SaveThread();
   return pass_string;
 }
 
+static long long monotonic_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Hands the messages queued in [first, first + available) to Python, one
+// message at a time or, for instances with a batch callback, a run of
+// consecutive messages for the same instance at once, until |deadline|.
+// Returns how many messages were handled. Must be called with the Python
+// lock held.
+static int dispatch_messages(int first, int available, long long deadline) {
+  int handled = 0;
+  while (handled < available && monotonic_ns() < deadline) {
+    int index = (first + handled) % DISPATCH_QUEUE_MAX;
+    XW_Instance instance = g_dispatch_queue[index].instance;
+    int has_callbacks = instance >= 0 && instance < EXTENSION_MAX;
+    PyObject* callback = has_callbacks ? g_py_messaging[instance] : NULL;
+    PyObject* batch_callback =
+        has_callbacks ? g_py_batch_messaging[instance] : NULL;
+    int count = 1;
+    if (batch_callback) {
+      while (handled + count < available &&
+             g_dispatch_queue[(index + count) % DISPATCH_QUEUE_MAX].instance ==
+                 instance)
+        ++count;
+    }
+
+    if (batch_callback) {
+      py_call_batch_message(instance, batch_callback, index, count);
+    } else if (callback) {
+      char* result = py_call_message(instance, callback,
+                                     g_dispatch_queue[index].message);
+      if (result)
+        free(result);
+    }
+
+    int i;
+    for (i = 0; i < count; ++i) {
+      struct queued_message* item =
+          &g_dispatch_queue[(index + i) % DISPATCH_QUEUE_MAX];
+      if (item->message != item->inline_message)
+        free(item->message);
+    }
+    handled += count;
+  }
+
+  return handled;
+}
+
+// Waits on |g_dispatch_queued| until |deadline_ns| on the monotonic clock, or
+// a signal. Must be called with |g_dispatch_mutex| held.
+static void dispatch_wait_until(long long deadline_ns) {
+  // The condition variable measures time on the realtime clock.
+  long long timeout_ns = deadline_ns - monotonic_ns();
+  if (timeout_ns <= 0)
+    return;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  timeout_ns += deadline.tv_nsec;
+  deadline.tv_sec += timeout_ns / 1000000000L;
+  deadline.tv_nsec = timeout_ns % 1000000000L;
+  pthread_cond_timedwait(&g_dispatch_queued, &g_dispatch_mutex, &deadline);
+}
+
+static void* dispatch_thread_main(void* data) {
+  // Create the thread state once, so batches don't pay for it and handlers
+  // keep their threading.local() data.
+  PyGILState_STATE gil_state = PyGILState_Ensure();
+  PyThreadState* thread_state = PyEval_SaveThread();
+
+  pthread_mutex_lock(&g_dispatch_mutex);
+  for (;;) {
+    while (!g_dispatch_length && g_dispatch_running) {
+      g_dispatch_state = DISPATCH_SLEEPING;
+      pthread_cond_wait(&g_dispatch_queued, &g_dispatch_mutex);
+    }
+
+    g_dispatch_state = DISPATCH_BUSY;
+    if (!g_dispatch_length)
+      break;
+
+    pthread_mutex_unlock(&g_dispatch_mutex);
+    PyEval_RestoreThread(thread_state);
+    long long deadline = monotonic_ns() + DISPATCH_BUDGET_NS;
+    pthread_mutex_lock(&g_dispatch_mutex);
+
+    for (;;) {
+      // Slots in [head, head + length) are only written by the Crosswalk
+      // thread before they are counted in, so they can be read without the
+      // mutex.
+      int first = g_dispatch_head;
+      int available = g_dispatch_length;
+      pthread_mutex_unlock(&g_dispatch_mutex);
+
+      int handled = dispatch_messages(first, available, deadline);
+
+      pthread_mutex_lock(&g_dispatch_mutex);
+      g_dispatch_head = (first + handled) % DISPATCH_QUEUE_MAX;
+      g_dispatch_length -= handled;
+      if (g_dispatch_producer_waiting &&
+          g_dispatch_length <= DISPATCH_QUEUE_MAX / 2)
+        pthread_cond_signal(&g_dispatch_space);
+
+      int budget_left = monotonic_ns() < deadline;
+      if (g_dispatch_length) {
+        if (budget_left)
+          continue;
+        break;
+      }
+
+      pthread_cond_broadcast(&g_dispatch_idle);
+      if (!g_dispatch_running || g_dispatch_yield || !budget_left)
+        break;
+
+      // Keep the Python lock a little longer in case the burst goes on.
+      long long linger = monotonic_ns() + DISPATCH_LINGER_NS;
+      g_dispatch_state = DISPATCH_LINGERING;
+      dispatch_wait_until(linger < deadline ? linger : deadline);
+      g_dispatch_state = DISPATCH_BUSY;
+      if (!g_dispatch_length)
+        break;
+    }
+    g_dispatch_yield = 0;
+
+    pthread_mutex_unlock(&g_dispatch_mutex);
+    PyEval_SaveThread();
+    pthread_mutex_lock(&g_dispatch_mutex);
+  }
+  pthread_mutex_unlock(&g_dispatch_mutex);
+
+  PyEval_RestoreThread(thread_state);
+  PyGILState_Release(gil_state);
+
+  return NULL;
+}
+
+// Waits until every queued message has been handled, and makes a lingering
+// dispatcher hand the Python lock back. Must be called without the Python
+// lock, as the dispatcher thread needs it to make progress.
+static void dispatch_flush() {
+  pthread_mutex_lock(&g_dispatch_mutex);
+  if (g_dispatch_state == DISPATCH_LINGERING) {
+    g_dispatch_yield = 1;
+    pthread_cond_signal(&g_dispatch_queued);
+  }
+  while (g_dispatch_length)
+    pthread_cond_wait(&g_dispatch_idle, &g_dispatch_mutex);
+  pthread_mutex_unlock(&g_dispatch_mutex);
+}
+
+static int dispatch_start() {
+  if (g_dispatch_running)
+    return 1;
+
+  g_dispatch_running = 1;
+  if (pthread_create(&g_dispatch_thread, NULL, dispatch_thread_main, NULL)) {
+    fprintf(stderr, "Could not start the pycrosswalk dispatcher thread.\n");
+    g_dispatch_running = 0;
+    return 0;
+  }
+
+  return 1;
+}
+
+// Handles the remaining messages and joins the dispatcher thread. Must be
+// called without the Python lock.
+static void dispatch_stop() {
+  pthread_mutex_lock(&g_dispatch_mutex);
+  if (!g_dispatch_running) {
+    pthread_mutex_unlock(&g_dispatch_mutex);
+    return;
+  }
+  g_dispatch_running = 0;
+  pthread_cond_signal(&g_dispatch_queued);
+  pthread_mutex_unlock(&g_dispatch_mutex);
+
+  pthread_join(g_dispatch_thread, NULL);
+}
+
 static void xw_handle_message(XW_Instance instance, const char* message) {
-  if (!g_py_messaging[instance])
+  size_t size = strlen(message) + 1;
+  char* heap_message = NULL;
+  if (size > DISPATCH_INLINE_SIZE) {
+    heap_message = malloc(size);
+    if (!heap_message)
+      return;
+    memcpy(heap_message, message, size);
+  }
+
+  pthread_mutex_lock(&g_dispatch_mutex);
+  while (g_dispatch_running && g_dispatch_length == DISPATCH_QUEUE_MAX) {
+    g_dispatch_producer_waiting = 1;
+    pthread_cond_wait(&g_dispatch_space, &g_dispatch_mutex);
+  }
+  g_dispatch_producer_waiting = 0;
+
+  if (g_dispatch_length == DISPATCH_QUEUE_MAX) {
+    pthread_mutex_unlock(&g_dispatch_mutex);
+    free(heap_message);
     return;
+  }
 
-  char* result = py_handle_message(instance, g_py_messaging[instance], message);
-  if (result)
-    free(result);
+  struct queued_message* item = &g_dispatch_queue[
+      (g_dispatch_head + g_dispatch_length) % DISPATCH_QUEUE_MAX];
+  item->instance = instance;
+  if (heap_message) {
+    item->message = heap_message;
+  } else {
+    memcpy(item->inline_message, message, size);
+    item->message = item->inline_message;
+  }
+  ++g_dispatch_length;
+
+  // A busy dispatcher will see the message anyway, and a lingering one
+  // within DISPATCH_LINGER_NS.
+  if (g_dispatch_state == DISPATCH_SLEEPING ||
+      (g_dispatch_state == DISPATCH_LINGERING &&
+       g_dispatch_length == DISPATCH_QUEUE_MAX / 4))
+    pthread_cond_signal(&g_dispatch_queued);
+  pthread_mutex_unlock(&g_dispatch_mutex);
 }
 
 static void xw_handle_sync_message(XW_Instance instance, const char* message) {
-  if (!g_py_sync_messaging[instance]) {
+  dispatch_flush();
+
+  if (instance < 0 || instance >= EXTENSION_MAX ||
+      !g_py_sync_messaging[instance]) {
     g_xw_sync_messaging->SetSyncReply(instance, "");
     return;
   }
@@ -255,12 +1179,17 @@ static void xw_handle_sync_message(XW_Instance instance, const char* message) {
     g_xw_sync_messaging->SetSyncReply(instance, "");
 }
 
-static char* py_handle_instance(XW_Instance instance, PyObject* callback) {
+static void py_handle_instance(XW_Instance instance, PyObject* callback,
+                               const char* extension_name, int alive) {
+  dispatch_flush();
+  set_instance_extension(instance, alive ? extension_name : NULL);
+  PyEval_RestoreThread(g_py_save_state);
+
   if (!callback) {
     fprintf(stderr, "Handle instance (created/destroyed) not set!\n");
-    return;
+    goto done;
   }
-  PyEval_RestoreThread(g_py_save_state);
+
   PyObject* instance_object = PyLong_FromLong((long) instance);
   PyObject* args = PyTuple_Pack(1, instance_object);
   Py_DECREF(instance_object);
@@ -270,7 +1199,9 @@ static char* py_handle_instance(XW_Instance instance, PyObject* callback) {
     goto done;
   }
 
+  profiler_enter_callback(instance, extension_name);
   PyObject* result_object = PyObject_CallObject(callback, args);
+  profiler_leave_callback();
   Py_DECREF(args);
 
   if (!result_object)
@@ -282,7 +1213,12 @@ static char* py_handle_instance(XW_Instance instance, PyObject* callback) {
 }
 
 static void xw_handle_shutdown(XW_Extension extension) {
+  if (--g_extension_count > 0)
+    return;
+
+  dispatch_stop();
   PyEval_RestoreThread(g_py_save_state);
+  profiler_stop();
   Py_Finalize();
 }
 
@@ -333,13 +1269,26 @@ static int load_python_extension(XW_Extension extension,
   return 1;
 }
 
-static void instance_closure(ffi_cif *cif, void *ret, void* args[],
-                             void *callback) {
+static void instance_created_closure(ffi_cif *cif, void *ret, void* args[],
+                                     void *data) {
+  int instance = *(int *)args[0];
+  struct instance_callback* callback = data;
+  py_handle_instance(instance, callback->callback,
+                     callback->extension_name, 1);
+}
+
+static void instance_destroyed_closure(ffi_cif *cif, void *ret, void* args[],
+                                       void *data) {
   int instance = *(int *)args[0];
-  py_handle_instance(instance, (PyObject *)callback);
+  struct instance_callback* callback = data;
+  py_handle_instance(instance, callback->callback,
+                     callback->extension_name, 0);
 }
 
-static XW_CreatedInstanceCallback alloc_instance_callback(PyObject* callback) {
+static XW_CreatedInstanceCallback alloc_instance_callback(
+    PyObject* py_callback,
+    const char* extension_name,
+    void (*fun)(ffi_cif*, void*, void**, void*)) {
   static int cif_initialized;
   static ffi_cif cif;
   static ffi_type *args[1];
@@ -351,13 +1300,17 @@ static XW_CreatedInstanceCallback alloc_instance_callback(PyObject* callback) {
     }
   }
 
-  if (cif_initialized) {
+  struct instance_callback* callback = malloc(sizeof(*callback));
+  if (cif_initialized && callback) {
     ffi_closure *closure;
     void *bound;
 
+    callback->callback = py_callback;
+    callback->extension_name = extension_name;
+
     closure = ffi_closure_alloc(sizeof(ffi_closure), &bound);
     if (closure) {
-      if (ffi_prep_closure_loc(closure, &cif, instance_closure,
+      if (ffi_prep_closure_loc(closure, &cif, fun,
                                callback, bound) == FFI_OK) {
         return (XW_CreatedInstanceCallback)bound;
       }
@@ -384,15 +1337,26 @@ int32_t XW_Initialize(XW_Extension extension, XW_GetInterface get_interface) {
   }
   dlclose(handle);
 
-  Py_Initialize();
-  PyEval_InitThreads();
+  // Later extensions reuse the interpreter set up by the first one.
+  if (Py_IsInitialized()) {
+    PyEval_RestoreThread(g_py_save_state);
+  } else {
+    Py_Initialize();
+    PyEval_InitThreads();
+  }
 
   int32_t result = XW_ERROR;
 
 #if PY_MAJOR_VERSION >= 3
   PyObject* xwalk_module = PyModule_Create(&PyXWalkModule);
+  struct module_state* state = get_module_state(xwalk_module);
 #else
-  PyObject *xwalk_module = Py_InitModule(PY_XWALK_MODULE_NAME, PyXWalkMethods);
+  // Leaked with the module, which lives as long as the extension process.
+  struct module_state* state = calloc(1, sizeof(*state));
+  PyObject* state_capsule = PyCapsule_New(state, NULL, NULL);
+  PyObject *xwalk_module = Py_InitModule4(PY_XWALK_MODULE_NAME, PyXWalkMethods,
+                                          NULL, state_capsule,
+                                          PYTHON_API_VERSION);
 #endif
   PyDict_SetItemString(PyImport_GetModuleDict(), PY_XWALK_MODULE_NAME, xwalk_module);
 
@@ -406,9 +1370,12 @@ int32_t XW_Initialize(XW_Extension extension, XW_GetInterface get_interface) {
 
   const XW_CoreInterface* core = get_interface(XW_CORE_INTERFACE);
 
-  core->SetExtensionName(extension, g_extension_name);
-  free(g_extension_name);
+  // The name is kept to tag the instances of this extension, e.g. in
+  // profiler samples. It lives as long as the closures below.
+  const char* extension_name = g_extension_name;
   g_extension_name = NULL;
+  core->SetExtensionName(extension, extension_name);
+  state->extension_name = extension_name;
 
   core->SetJavaScriptAPI(extension, g_javascript_api);
   free(g_javascript_api);
@@ -416,25 +1383,31 @@ int32_t XW_Initialize(XW_Extension extension, XW_GetInterface get_interface) {
 
   // We need to create a closure here otherwise the callback is going to be
   // replaced by the next python extension, which makes it impossible to
-  // support multiple extensions otherwise. I'm leaking the closure structure
-  // and the callback object, but their lifecycle is the same as the extension
-  // process (so effectively the memory won't leak).
-  XW_CreatedInstanceCallback instance_created = alloc_instance_callback(g_py_instance_created);
+  // support multiple extensions otherwise. I'm leaking the closure structure,
+  // its user data and the callback object, but their lifecycle is the same as
+  // the extension process (so effectively the memory won't leak).
+  XW_CreatedInstanceCallback instance_created = alloc_instance_callback(
+      g_py_instance_created, extension_name, instance_created_closure);
   g_py_instance_created = NULL;
 
-  XW_DestroyedInstanceCallback instance_destroyed = alloc_instance_callback(g_py_instance_destroyed);
+  XW_DestroyedInstanceCallback instance_destroyed = alloc_instance_callback(
+      g_py_instance_destroyed, extension_name, instance_destroyed_closure);
   g_py_instance_destroyed = NULL;
 
   core->RegisterInstanceCallbacks(extension, instance_created, instance_destroyed);
 
   core->RegisterShutdownCallback(extension, xw_handle_shutdown);
 
+  if (!dispatch_start())
+    goto done;
+
   g_xw_messaging = get_interface(XW_MESSAGING_INTERFACE);
   g_xw_messaging->Register(extension, xw_handle_message);
 
   g_xw_sync_messaging = get_interface(XW_INTERNAL_SYNC_MESSAGING_INTERFACE);
   g_xw_sync_messaging->Register(extension, xw_handle_sync_message);
 
+  ++g_extension_count;
   result = XW_OK;
 
  done: